@@ -28,6 +28,7 @@
 #ifndef ARENA_H
 #define ARENA_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -40,11 +41,39 @@ typedef struct region_t {
     char data[];
 } region_t;
 
+// source of the regions of an arena, allocate returns a region with at least
+// capacity bytes of data and its capacity field set, or NULL when out of memory.
+// last is the newest region of the arena asking, NULL for its first one
+typedef struct region_provider_t {
+    region_t* (*allocate)(struct region_provider_t* provider, region_t* last, size_t capacity);
+    void (*release)(struct region_provider_t* provider, region_t* region);
+} region_provider_t;
+
+// carves regions out of a caller buffer, released regions are reused
+typedef struct {
+    region_provider_t base;
+    char* buffer;
+    size_t size;
+    size_t used;
+    region_t* free_regions;
+} fixed_region_provider_t;
+
 typedef struct arena_t {
     region_t* first;
     struct arena_t* parent;
+    region_provider_t* provider; // NULL uses malloc_region_provider
+    bool out_of_memory; // set when an allocation returned NULL
 } arena_t;
 
+extern region_provider_t malloc_region_provider;
+// keeps up to REGION_CACHE_MAX released regions per thread for reuse,
+// they are not returned to malloc when the thread exits
+extern region_provider_t cached_region_provider;
+// mmap chunks advised for huge pages, each one twice the size of the
+// previous region of the same arena
+extern region_provider_t mmap_region_provider;
+region_provider_t* fixed_region_provider_init(fixed_region_provider_t* provider, void* buffer, size_t size);
+
 void arena_free(arena_t* ctx);
 void* arena_malloc(arena_t* ctx, size_t size);
 void* arena_calloc(arena_t* ctx, size_t nmemb, size_t size);
@@ -52,32 +81,188 @@ void* arena_realloc(arena_t* ctx, void* ptr, size_t oldsize, size_t size);
 char* arena_strdup(arena_t* ctx, const char* s);
 
 #define DA_INIT_CAPACITY 10
+// when the arena is out of memory the array is left unchanged
 #define arena_da_append(ctx, array, item) do { \
     if((array)->count >= (array)->capacity) { \
+        void* new_items; \
+        size_t new_capacity; \
         if((array)->capacity == 0) { \
-            (array)->items = arena_malloc((ctx), DA_INIT_CAPACITY*sizeof((array)->items[0])); \
-            (array)->capacity = DA_INIT_CAPACITY; \
+            new_capacity = DA_INIT_CAPACITY; \
+            new_items = arena_malloc((ctx), new_capacity*sizeof((array)->items[0])); \
         } else {\
-            (array)->items = arena_realloc((ctx), (array)->items, (array)->capacity*sizeof((array)->items[0]), (array)->capacity*2*sizeof((array)->items[0])); \
-            (array)->capacity *= 2; \
+            new_capacity = (array)->capacity*2; \
+            new_items = arena_realloc((ctx), (array)->items, (array)->capacity*sizeof((array)->items[0]), new_capacity*sizeof((array)->items[0])); \
         } \
+        if(new_items != NULL) { \
+            (array)->items = new_items; \
+            (array)->capacity = new_capacity; \
+        } \
+    } \
+    if((array)->count < (array)->capacity) { \
+        (array)->items[(array)->count] = (item); \
+        (array)->count++; \
     } \
-    (array)->items[(array)->count] = (item); \
-    (array)->count++; \
 } while(0) \
 
 #ifdef ARENA_IMPLEMENTATION
 
+#include <sys/mman.h>
+
+#define MMAP_REGION_MIN_SIZE (2*1024*1024)
+#define MMAP_REGION_MAX_SIZE ((size_t)1024*1024*1024)
+#define REGION_CACHE_MAX 16
+
 size_t space_in_region(region_t* region) {
     if(region == NULL) return -1;
     return region->capacity - region->size;
 }
 
-region_t* allocate_region(size_t size) {
+region_t* malloc_allocate(region_provider_t* provider, region_t* last, size_t capacity) {
+    (void)provider;
+    (void)last;
+    region_t* region = (region_t*)malloc(sizeof(region_t) + capacity);
+    if(region == NULL) return NULL;
+    region->capacity = capacity;
+    return region;
+}
+
+void malloc_release(region_provider_t* provider, region_t* region) {
+    (void)provider;
+    free(region);
+}
+
+region_provider_t malloc_region_provider = {malloc_allocate, malloc_release};
+
+_Thread_local region_t* cached_regions = NULL;
+_Thread_local size_t cached_regions_count = 0;
+
+region_t* cached_allocate(region_provider_t* provider, region_t* last, size_t capacity) {
+    region_t* previous = NULL;
+    for(region_t* region = cached_regions; region != NULL; region = region->next) {
+        if(region->capacity >= capacity) {
+            if(previous == NULL) {
+                cached_regions = region->next;
+            } else {
+                previous->next = region->next;
+            }
+            cached_regions_count--;
+            return region;
+        }
+        previous = region;
+    }
+    return malloc_allocate(provider, last, capacity);
+}
+
+void cached_release(region_provider_t* provider, region_t* region) {
+    if(cached_regions_count >= REGION_CACHE_MAX) {
+        malloc_release(provider, region);
+        return;
+    }
+    region->next = cached_regions;
+    cached_regions = region;
+    cached_regions_count++;
+}
+
+region_provider_t cached_region_provider = {cached_allocate, cached_release};
+
+region_t* mmap_allocate(region_provider_t* provider, region_t* last, size_t capacity) {
+    (void)provider;
+    size_t size = MMAP_REGION_MIN_SIZE;
+    if(last != NULL) {
+        size_t last_size = sizeof(region_t) + last->capacity;
+        size = (last_size >= MMAP_REGION_MAX_SIZE/2) ? MMAP_REGION_MAX_SIZE : 2*last_size;
+    }
+    while(size < sizeof(region_t) + capacity) size *= 2;
+
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(data, size, MADV_HUGEPAGE);
+#endif
+    region_t* region = (region_t*)data;
+    region->capacity = size - sizeof(region_t);
+    return region;
+}
+
+void mmap_release(region_provider_t* provider, region_t* region) {
+    (void)provider;
+    munmap(region, sizeof(region_t) + region->capacity);
+}
+
+region_provider_t mmap_region_provider = {mmap_allocate, mmap_release};
+
+region_t* fixed_allocate(region_provider_t* provider, region_t* last, size_t capacity) {
+    (void)last;
+    fixed_region_provider_t* fixed_provider = (fixed_region_provider_t*)provider;
+    region_t* previous = NULL;
+    for(region_t* region = fixed_provider->free_regions; region != NULL; region = region->next) {
+        if(region->capacity >= capacity) {
+            if(previous == NULL) {
+                fixed_provider->free_regions = region->next;
+            } else {
+                previous->next = region->next;
+            }
+            return region;
+        }
+        previous = region;
+    }
+
+    // regions are laid out back to back, so releasing the last one in the
+    // buffer can always give its space back
+    size_t alignment = _Alignof(region_t);
+    size_t start = (fixed_provider->used + alignment - 1) & ~(alignment - 1);
+    capacity = (capacity + alignment - 1) & ~(alignment - 1);
+    if(start > fixed_provider->size || fixed_provider->size - start < sizeof(region_t) + capacity) return NULL;
+
+    region_t* region = (region_t*)&fixed_provider->buffer[start];
+    region->capacity = capacity;
+    fixed_provider->used = start + sizeof(region_t) + capacity;
+    return region;
+}
+
+bool fixed_region_ends_buffer(fixed_region_provider_t* fixed_provider, region_t* region) {
+    return region->data + region->capacity == fixed_provider->buffer + fixed_provider->used;
+}
+
+// the region at the end of the used part gives its space back, and so do the
+// free regions it uncovers, the others wait in the free list
+void fixed_release(region_provider_t* provider, region_t* region) {
+    fixed_region_provider_t* fixed_provider = (fixed_region_provider_t*)provider;
+    region->next = fixed_provider->free_regions;
+    fixed_provider->free_regions = region;
+
+    bool released = true;
+    while(released) {
+        released = false;
+        region_t** link = &fixed_provider->free_regions;
+        while(*link != NULL) {
+            if(fixed_region_ends_buffer(fixed_provider, *link)) {
+                fixed_provider->used = (char*)*link - fixed_provider->buffer;
+                *link = (*link)->next;
+                released = true;
+            } else {
+                link = &(*link)->next;
+            }
+        }
+    }
+}
+
+region_provider_t* fixed_region_provider_init(fixed_region_provider_t* provider, void* buffer, size_t size) {
+    provider->base = (region_provider_t){fixed_allocate, fixed_release};
+    provider->buffer = (char*)buffer;
+    provider->size = size;
+    provider->used = 0;
+    provider->free_regions = NULL;
+    return &provider->base;
+}
+
+region_t* allocate_region(arena_t* ctx, region_t* last, size_t size) {
     size_t allocated_size = (size < DEFAULT_ALLOC_SIZE) ? DEFAULT_ALLOC_SIZE : size;
+    region_provider_t* provider = (ctx->provider == NULL) ? &malloc_region_provider : ctx->provider;
 
-    region_t* region = (region_t*)malloc(sizeof(region_t) + allocated_size);
-    region->capacity = allocated_size;
+    region_t* region = provider->allocate(provider, last, allocated_size);
+    if(region == NULL && allocated_size > size) region = provider->allocate(provider, last, size);
+    if(region == NULL) return NULL;
     region->size = size;
     region->next = NULL;
     return region;
@@ -85,11 +270,12 @@ region_t* allocate_region(size_t size) {
 
 void arena_free(arena_t* ctx) {
     if(ctx == NULL) return;
+    region_provider_t* provider = (ctx->provider == NULL) ? &malloc_region_provider : ctx->provider;
     region_t* region = ctx->first;
     while(region != NULL) {
         region_t* current_region = region;
         region = region->next;
-        free(current_region);
+        provider->release(provider, current_region);
     }
     ctx->first = NULL;
 }
@@ -98,7 +284,11 @@ void* arena_malloc(arena_t* ctx, size_t size) {
     if(ctx == NULL || size == 0) return NULL;
 
     if(ctx->first == NULL) {
-        ctx->first = allocate_region(size);
+        ctx->first = allocate_region(ctx, NULL, size);
+        if(ctx->first == NULL) {
+            ctx->out_of_memory = true;
+            return NULL;
+        }
         return (void*)ctx->first->data;
     }
 
@@ -115,7 +305,11 @@ void* arena_malloc(arena_t* ctx, size_t size) {
         current_region = current_region->next;
     }
 
-    previous_region->next = allocate_region(size);
+    previous_region->next = allocate_region(ctx, previous_region, size);
+    if(previous_region->next == NULL) {
+        ctx->out_of_memory = true;
+        return NULL;
+    }
     return (void*)previous_region->next->data;
 }
 
@@ -123,6 +317,7 @@ void* arena_calloc(arena_t* ctx, size_t nmemb, size_t size) {
     if(ctx == NULL || size == 0 || nmemb == 0) return NULL;
 
     void* ptr = arena_malloc(ctx, nmemb*size);
+    if(ptr == NULL) return NULL;
     memset(ptr, 0, nmemb*size);
     
     return ptr;
@@ -133,6 +328,7 @@ void* arena_realloc(arena_t* ctx, void* oldptr, size_t oldsize, size_t size) {
     if(oldsize > size) return oldptr;
 
     void* newptr = arena_malloc(ctx, size);
+    if(newptr == NULL) return NULL;
     memcpy(newptr, oldptr, oldsize);
     return newptr;
 }
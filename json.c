@@ -1,6 +1,14 @@
+#define _DEFAULT_SOURCE
 #define ARENA_IMPLEMENTATION
 #include "json.h"
 
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef enum {
     TK_NO_TOKEN,
     TK_LEXER_ERROR,
@@ -23,6 +31,8 @@ typedef struct {
         char* string;
         double number;
     };
+    const char* start;
+    const char* end;
 } Token;
 
 typedef struct {
@@ -42,13 +52,109 @@ typedef struct {
     size_t count;
 } StringBuilder;
 
+typedef struct {
+    uintptr_t* items;
+    size_t capacity;
+    size_t count;
+} DirtySpans;
+
+// slots hold an item position + 1, 0 is an empty slot
+typedef struct JsonObjectIndex {
+    size_t capacity;
+    size_t used;
+    size_t removed;
+    size_t slots[];
+} JsonObjectIndex;
+
+#define INDEX_MIN_COUNT 16
+#define INDEX_DELETED_SLOT SIZE_MAX
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// receives the canonical form, appended to sb or hashed when sb is NULL
+typedef struct {
+    StringBuilder* sb;
+    uint64_t hash;
+    arena_t scratch;
+} CanonicalSink;
+
+// with data == NULL only measures, so the same walk sizes and fills the block
+typedef struct {
+    char* data;
+    size_t size;
+} CloneBlock;
+
 arena_t arena = {0};
 arena_t temp_arena = {0};
 
+// sorted start addresses of the modified source spans, once a mark could not
+// be recorded no span is trusted anymore
+DirtySpans dirty_spans = {0};
+bool dirty_spans_lost = false;
+
+int lexer_flags = JSON_PARSE_DEFAULT;
+const char* lexer_error_position = NULL;
+
+void sb_append_n(StringBuilder* sb, const char* data, size_t length) {
+    if(length == 0) return;
+    if(sb->count + length > sb->capacity) {
+        size_t capacity = (sb->capacity == 0) ? DA_INIT_CAPACITY : sb->capacity;
+        while(capacity < sb->count + length) capacity *= 2;
+        char* items;
+        if(sb->capacity == 0) {
+            items = arena_malloc(&arena, capacity);
+        } else {
+            items = arena_realloc(&arena, sb->items, sb->capacity, capacity);
+        }
+        if(items == NULL) return;
+        sb->items = items;
+        sb->capacity = capacity;
+    }
+    memcpy(&sb->items[sb->count], data, length);
+    sb->count += length;
+}
+
 void sb_append(StringBuilder* sb, const char* string) {
-    for(size_t i = 0; i < strlen(string); i++) {
-        arena_da_append(&arena, sb, string[i]);
+    sb_append_n(sb, string, strlen(string));
+}
+
+size_t dirty_spans_lower_bound(uintptr_t address) {
+    size_t low = 0;
+    size_t high = dirty_spans.count;
+    while(low < high) {
+        size_t middle = low + (high - low)/2;
+        if(dirty_spans.items[middle] < address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void mark_source_modified(const char* source) {
+    if(source == NULL) return;
+    uintptr_t address = (uintptr_t)source;
+    size_t index = dirty_spans_lower_bound(address);
+    if(index < dirty_spans.count && dirty_spans.items[index] == address) return;
+    size_t count = dirty_spans.count;
+    arena_da_append(&arena, &dirty_spans, address);
+    if(dirty_spans.count == count) {
+        dirty_spans_lost = true;
+        return;
     }
+    memmove(&dirty_spans.items[index+1], &dirty_spans.items[index], (dirty_spans.count-1-index)*sizeof(dirty_spans.items[0]));
+    dirty_spans.items[index] = address;
+}
+
+// spans nest like the values they come from, so a span is unchanged when no
+// modified span starts inside it
+bool source_is_unmodified(const char* source, size_t source_length) {
+    if(source == NULL || dirty_spans_lost) return false;
+    uintptr_t address = (uintptr_t)source;
+    size_t index = dirty_spans_lower_bound(address);
+    return index == dirty_spans.count || dirty_spans.items[index] >= address + source_length;
 }
 
 Token token_iterator_next(TokenIterator* tk_iterator) {
@@ -124,45 +230,131 @@ void skip_space(const char** json_string_iterator) {
     *json_string_iterator += cursor;
 }
 
-Token lex_string(const char** json_string_iterator) {
-    size_t cursor = 0;
-    Token token;
-    char current = (*json_string_iterator)[cursor];
-    if(current == '"') {
-        cursor++;
-        current = (*json_string_iterator)[cursor];
-        StringBuilder string_data = {0};
-        while(current != '"' && current != '\0') {
-            arena_da_append(&arena, &string_data, current);
-            cursor++;
-            current = (*json_string_iterator)[cursor];
+// lead byte -> sequence length and accepted range of the second byte,
+// the remaining continuation bytes are always 0x80..0xBF
+typedef struct {
+    unsigned char length;
+    unsigned char second_min;
+    unsigned char second_max;
+} Utf8Lead;
+
+Utf8Lead utf8_lead(unsigned char lead) {
+    if(lead >= 0xC2 && lead <= 0xDF) return (Utf8Lead){2, 0x80, 0xBF};
+    if(lead == 0xE0) return (Utf8Lead){3, 0xA0, 0xBF};
+    if(lead == 0xED) return (Utf8Lead){3, 0x80, 0x9F};
+    if(lead >= 0xE1 && lead <= 0xEF) return (Utf8Lead){3, 0x80, 0xBF};
+    if(lead == 0xF0) return (Utf8Lead){4, 0x90, 0xBF};
+    if(lead == 0xF4) return (Utf8Lead){4, 0x80, 0x8F};
+    if(lead >= 0xF1 && lead <= 0xF3) return (Utf8Lead){4, 0x80, 0xBF};
+    return (Utf8Lead){0};
+}
+
+size_t utf8_sequence_length(const unsigned char* bytes, size_t remaining) {
+    Utf8Lead lead = utf8_lead(bytes[0]);
+    if(lead.length == 0 || lead.length > remaining) return 0;
+    if(bytes[1] < lead.second_min || bytes[1] > lead.second_max) return 0;
+    for(size_t i = 2; i < lead.length; i++) {
+        if(bytes[i] < 0x80 || bytes[i] > 0xBF) return 0;
+    }
+    return lead.length;
+}
+
+bool validate_utf8(const char* data, size_t length, size_t* error_offset) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t i = 0;
+    while(i < length) {
+#ifdef __SSE2__
+        if(i + 16 <= length) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + i));
+            if(_mm_movemask_epi8(chunk) == 0) {
+                i += 16;
+                continue;
+            }
         }
-        if(current != '\0') {
-            arena_da_append(&arena, &string_data, '\0');
-            token = new_token_string(TK_STRING, arena_strdup(&temp_arena, string_data.items)); // fixme : remove arena_dup
-            cursor++;
-            *json_string_iterator += cursor;
-        } else {
-            token = new_token_string(TK_LEXER_ERROR, "unclosed string");
-            *json_string_iterator += strlen(*json_string_iterator);
+#endif
+        if(i + 8 <= length) {
+            uint64_t chunk;
+            memcpy(&chunk, bytes + i, sizeof(chunk));
+            if((chunk & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
         }
-    } else {
-        token = (Token){TK_NO_TOKEN};
+        if(bytes[i] < 0x80) {
+            i++;
+            continue;
+        }
+        size_t sequence_length = utf8_sequence_length(bytes + i, length - i);
+        if(sequence_length == 0) {
+            if(error_offset != NULL) *error_offset = i;
+            return false;
+        }
+        i += sequence_length;
     }
+    return true;
+}
 
-    return token;
+Token lex_error(const char** json_string_iterator, const char* position, const char* message) {
+    if(lexer_error_position == NULL) lexer_error_position = position;
+    *json_string_iterator += strlen(*json_string_iterator);
+    return new_token_string(TK_LEXER_ERROR, message);
 }
 
-Token lex_number(const char** json_string_iterator) {
-    Token token;
-    char* eptr = NULL;
-    double number = strtod(*json_string_iterator, &eptr);
-    if(eptr != *json_string_iterator) {
-        token = new_token_number(TK_NUMBER, number);
-        *json_string_iterator = eptr;
+Token lex_string(const char** json_string_iterator) {
+    const char* start = *json_string_iterator;
+    if(*start != '"') return (Token){TK_NO_TOKEN};
+
+    const char* end = strchr(start + 1, '"');
+    if(end == NULL) return lex_error(json_string_iterator, start, "unclosed string");
+
+    size_t length = end - (start + 1);
+    size_t invalid_offset;
+    if((lexer_flags & JSON_PARSE_VALIDATE_UTF8) && !validate_utf8(start + 1, length, &invalid_offset)) {
+        return lex_error(json_string_iterator, start + 1 + invalid_offset, "invalid utf-8");
+    }
+
+    char* string = arena_malloc(&temp_arena, length + 1);
+    if(string == NULL) return lex_error(json_string_iterator, start, "out of memory");
+    memcpy(string, start + 1, length);
+    string[length] = '\0';
+    *json_string_iterator = end + 1;
+    return (Token){TK_STRING, .string = string};
+}
+
+// end of the number starting at string following the JSON grammar,
+// string itself when there is none
+const char* scan_number(const char* string) {
+    const char* c = string;
+    if(*c == '-') c++;
+    if(*c == '0') {
+        c++;
+    } else if(*c >= '1' && *c <= '9') {
+        while(isdigit((unsigned char)*c)) c++;
     } else {
-        token = (Token){TK_NO_TOKEN};
+        return string;
     }
+    if(c[0] == '.' && isdigit((unsigned char)c[1])) {
+        c++;
+        while(isdigit((unsigned char)*c)) c++;
+    }
+    if(c[0] == 'e' || c[0] == 'E') {
+        const char* exponent = c + 1;
+        if(*exponent == '+' || *exponent == '-') exponent++;
+        if(isdigit((unsigned char)*exponent)) {
+            c = exponent;
+            while(isdigit((unsigned char)*c)) c++;
+        }
+    }
+    return c;
+}
+
+Token lex_number(const char** json_string_iterator) {
+    const char* end = scan_number(*json_string_iterator);
+    if(end == *json_string_iterator) return (Token){TK_NO_TOKEN};
+    // raw numbers are converted on access from the token span
+    double number = (lexer_flags & JSON_PARSE_RAW_NUMBERS) ? 0 : strtod(*json_string_iterator, NULL);
+    Token token = new_token_number(TK_NUMBER, number);
+    *json_string_iterator = end;
     return token;
 }
 
@@ -177,11 +369,9 @@ Token lex_atom(const char** json_string_iterator, const char* atom, TOKEN_TYPE a
     return token;
 }
 
-Token next_token(const char** json_string_iterator) {
+Token lex_token(const char** json_string_iterator) {
     Token token = {0};
 
-    skip_space(json_string_iterator);
-
     token = lex_symbols(json_string_iterator);
     if(token.type != TK_NO_TOKEN) return token;
 
@@ -203,8 +393,19 @@ Token next_token(const char** json_string_iterator) {
     token = lex_atom(json_string_iterator, "null", TK_NULL);
     if(token.type != TK_NO_TOKEN) return token;
 
-    token = new_token_string(TK_LEXER_ERROR, "unknown symbol");
-    *json_string_iterator += strlen(*json_string_iterator);
+    return lex_error(json_string_iterator, *json_string_iterator, "unknown symbol");
+}
+
+Token next_token(const char** json_string_iterator) {
+    Token token = {0};
+
+    skip_space(json_string_iterator);
+    if(**json_string_iterator == '\0') return token;
+
+    const char* start = *json_string_iterator;
+    token = lex_token(json_string_iterator);
+    token.start = start;
+    token.end = *json_string_iterator;
     return token;
 }
 
@@ -213,12 +414,22 @@ TokenList lex_json_string(const char* json_string) {
     TokenList tokens = {0};
 
     while (*json_string_iterator != '\0') {
-        arena_da_append(&temp_arena, &tokens, next_token(&json_string_iterator));
+        Token token = next_token(&json_string_iterator);
+        if(token.type == TK_NO_TOKEN) break;
+        arena_da_append(&temp_arena, &tokens, token);
     }
 
     return tokens;
 }
 
+// the span from the opening to the closing bracket, only kept with
+// JSON_PARSE_KEEP_SOURCE
+void set_container_source(const char** source, size_t* source_length, Token open_token, Token close_token) {
+    if(!(lexer_flags & JSON_PARSE_KEEP_SOURCE)) return;
+    *source = open_token.start;
+    *source_length = close_token.end - open_token.start;
+}
+
 JsonObject parse_json_object(TokenIterator* tk_iterator, bool* valid);
 
 JsonArray parse_json_array(TokenIterator* tk_iterator, bool* valid);
@@ -253,8 +464,14 @@ JsonValue parse_json_value(TokenIterator* tk_iterator, bool* valid) {
             token_iterator_next(tk_iterator);
             break;
         case TK_NUMBER:
-            json_value.type = NUMBER;
-            json_value.number = token.number;
+            if(lexer_flags & JSON_PARSE_RAW_NUMBERS) {
+                json_value.type = RAW_NUMBER;
+                json_value.number_text = token.start;
+                json_value.number_length = token.end - token.start;
+            } else {
+                json_value.type = NUMBER;
+                json_value.number = token.number;
+            }
             token_iterator_next(tk_iterator);
             break;
         case TK_TRUE:
@@ -309,13 +526,15 @@ JsonArray parse_json_array(TokenIterator* tk_iterator, bool* valid) {
     JsonArray json_array = {0};
     *valid = true;
 
-    if(token_iterator_next(tk_iterator).type != TK_OPEN_SQUARE_BRACKET) {
+    Token open_token = token_iterator_next(tk_iterator);
+    if(open_token.type != TK_OPEN_SQUARE_BRACKET) {
         *valid = false;
         return (JsonArray){0};
     }
 
     if(token_iterator_pick_next(tk_iterator).type == TK_CLOSE_SQUARE_BRACKET) {
-        token_iterator_next(tk_iterator);
+        Token close_token = token_iterator_next(tk_iterator);
+        set_container_source(&json_array.source, &json_array.source_length, open_token, close_token);
         return json_array;
     }
 
@@ -338,10 +557,12 @@ JsonArray parse_json_array(TokenIterator* tk_iterator, bool* valid) {
         
     }
 
-    if(token_iterator_next(tk_iterator).type != TK_CLOSE_SQUARE_BRACKET) {
+    Token close_token = token_iterator_next(tk_iterator);
+    if(close_token.type != TK_CLOSE_SQUARE_BRACKET) {
         *valid = false;
         return (JsonArray){0};
     }
+    set_container_source(&json_array.source, &json_array.source_length, open_token, close_token);
 
     return json_array;
 }
@@ -350,13 +571,15 @@ JsonObject parse_json_object(TokenIterator* tk_iterator, bool* valid) {
     JsonObject json_object = {0};
     *valid = true;
 
-    if(token_iterator_next(tk_iterator).type != TK_OPEN_CURLY_BRACKET) {
+    Token open_token = token_iterator_next(tk_iterator);
+    if(open_token.type != TK_OPEN_CURLY_BRACKET) {
         *valid = false;
         return (JsonObject){0};
     }
 
     if(token_iterator_pick_next(tk_iterator).type == TK_CLOSE_CURLY_BRACKET) {
-        token_iterator_next(tk_iterator);
+        Token close_token = token_iterator_next(tk_iterator);
+        set_container_source(&json_object.source, &json_object.source_length, open_token, close_token);
         return json_object;
     }
 
@@ -378,10 +601,12 @@ JsonObject parse_json_object(TokenIterator* tk_iterator, bool* valid) {
         
     }
 
-    if(token_iterator_next(tk_iterator).type != TK_CLOSE_CURLY_BRACKET) {
+    Token close_token = token_iterator_next(tk_iterator);
+    if(close_token.type != TK_CLOSE_CURLY_BRACKET) {
         *valid = false;
         return (JsonObject){0};
     }
+    set_container_source(&json_object.source, &json_object.source_length, open_token, close_token);
 
     return json_object;
 }
@@ -453,7 +678,8 @@ void print_value(const JsonValue* json_value, size_t indent) {
             printf("\"%s\"", json_value->string);
             break;
         case NUMBER:
-            printf("%f", json_value->number);
+        case RAW_NUMBER:
+            printf("%f", json_number(json_value));
             break;
         case BOOLEAN:
             printf("%s", json_value->boolean ? "true" : "false");
@@ -476,6 +702,7 @@ void print_json_array(const JsonArray* json_array, size_t indent) {
 void print_json_object(const JsonObject* json_object, size_t indent) {
     for (size_t i = 0; i < json_object->count; i++) {
         JsonElement json_element = json_object->items[i];
+        if(json_element.name == NULL) continue;
         print_tabs(indent);
         printf("%s : ", json_element.name);
         print_value(&json_element.value, indent);
@@ -483,24 +710,60 @@ void print_json_object(const JsonObject* json_object, size_t indent) {
     }
 }
 
-JsonObject parse_json_string(const char* json_string, bool* valid) {
-    TokenList tokens = lex_json_string(json_string);
+JsonObject parse_json_string_with_flags(const char* json_string, int flags, bool* valid, size_t* error_offset) {
+    lexer_flags = flags;
+    lexer_error_position = NULL;
+    // source spans and raw numbers view this copy, it lives as long as they do
+    const char* source = json_string;
+    if(flags & (JSON_PARSE_KEEP_SOURCE | JSON_PARSE_RAW_NUMBERS)) {
+        size_t source_length = strlen(json_string);
+        char* copy = arena_malloc(&arena, source_length + 1);
+        if(copy == NULL) {
+            *valid = false;
+            return (JsonObject){0};
+        }
+        memcpy(copy, json_string, source_length + 1);
+        source = copy;
+    }
+    TokenList tokens = lex_json_string(source);
     TokenIterator tk_iterator = {
         .tokens = &tokens,
         .iterator_index = 0
     };
     bool is_valid;
     JsonObject result = parse_json_object(&tk_iterator, &is_valid);
+    Token trailing_token = token_iterator_pick_next(&tk_iterator);
+    if(is_valid && trailing_token.type != TK_NO_TOKEN) {
+        is_valid = false;
+        result = (JsonObject){0};
+        if(error_offset != NULL) *error_offset = trailing_token.start - source;
+    }
+    if(lexer_error_position != NULL) {
+        is_valid = false;
+        result = (JsonObject){0};
+        if(error_offset != NULL) *error_offset = lexer_error_position - source;
+    }
+    // a failure of the token scratch is reported like any other allocation
+    if(temp_arena.out_of_memory) arena.out_of_memory = true;
+    if(arena.out_of_memory) {
+        is_valid = false;
+        result = (JsonObject){0};
+    }
     *valid = is_valid;
     arena_free(&temp_arena);
+    temp_arena.out_of_memory = false;
     return result;
 }
 
+JsonObject parse_json_string(const char* json_string, bool* valid) {
+    return parse_json_string_with_flags(json_string, JSON_PARSE_DEFAULT, valid, NULL);
+}
+
 void write_json_object(const JsonObject* json_object, StringBuilder* sb);
 void write_json_array(const JsonArray* json_array, StringBuilder* sb);
 
 void write_value(const JsonValue* json_value, StringBuilder* sb) {
-    char* double_buf = arena_malloc(&temp_arena, DBL_MAX_10_EXP+2);
+    char double_buf[DBL_MAX_10_EXP+16];
     switch (json_value->type) {
         case OBJECT:
             write_json_object(&json_value->object, sb);
@@ -514,9 +777,12 @@ void write_value(const JsonValue* json_value, StringBuilder* sb) {
             sb_append(sb, "\"");
             break;
         case NUMBER:
-            sprintf(double_buf, "%f", json_value->number);
+            snprintf(double_buf, sizeof(double_buf), "%f", json_value->number);
             sb_append(sb, double_buf);
             break;
+        case RAW_NUMBER:
+            sb_append_n(sb, json_value->number_text, json_value->number_length);
+            break;
         case BOOLEAN:
             if(json_value->boolean) {
                 sb_append(sb, "true");
@@ -529,10 +795,13 @@ void write_value(const JsonValue* json_value, StringBuilder* sb) {
             break;
         break;
     }
-    arena_free(&temp_arena);
 }
 
 void write_json_array(const JsonArray* json_array, StringBuilder* sb) {
+    if(source_is_unmodified(json_array->source, json_array->source_length)) {
+        sb_append_n(sb, json_array->source, json_array->source_length);
+        return;
+    }
     sb_append(sb, "[");
     for (size_t i = 0; i < json_array->count; i++) {
         write_value(&json_array->items[i], sb);
@@ -542,15 +811,22 @@ void write_json_array(const JsonArray* json_array, StringBuilder* sb) {
 }
 
 void write_json_object(const JsonObject* json_object, StringBuilder* sb) {
+    if(source_is_unmodified(json_object->source, json_object->source_length)) {
+        sb_append_n(sb, json_object->source, json_object->source_length);
+        return;
+    }
     sb_append(sb, "{");
+    bool first = true;
     for (size_t i = 0; i < json_object->count; i++) {
         JsonElement json_element = json_object->items[i];
+        if(json_element.name == NULL) continue;
+        if(!first) sb_append(sb, ",");
+        first = false;
         sb_append(sb, "\"");
         sb_append(sb, json_element.name);
         sb_append(sb, "\"");
         sb_append(sb, ":");
         write_value(&json_element.value, sb);
-        if(i < json_object->count-1) sb_append(sb, ",");
     }
     sb_append(sb, "}");
 }
@@ -559,66 +835,485 @@ char* write_json(const JsonObject* json_object) {
     StringBuilder sb = {0};
     write_json_object(json_object, &sb);
     arena_da_append(&arena, &sb, '\0');
-    return sb.items;
+    return arena.out_of_memory ? NULL : sb.items;
 }
 
-const JsonValue* get_by_name(const JsonObject* json_object, const char* name) {
+uint64_t fnv1a_update(uint64_t hash, const char* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+uint64_t json_hash_bytes(const char* data, size_t length) {
+    return fnv1a_update(FNV_OFFSET_BASIS, data, length);
+}
+
+void canonical_emit(CanonicalSink* sink, const char* data, size_t length) {
+    if(sink->sb != NULL) {
+        sb_append_n(sink->sb, data, length);
+    } else {
+        sink->hash = fnv1a_update(sink->hash, data, length);
+    }
+}
+
+void canonical_sink_emit(void* sink, const char* data, size_t length) {
+    canonical_emit(sink, data, length);
+}
+
+// quotes string escaping '"', '\\' and control characters, so that distinct
+// strings never produce the same text
+void emit_quoted(const char* string, void (*emit)(void* context, const char* data, size_t length), void* context) {
+    static const char hex[] = "0123456789abcdef";
+    emit(context, "\"", 1);
+    const char* run = string;
+    for(const char* c = string; *c != '\0'; c++) {
+        unsigned char current = (unsigned char)*c;
+        if(current >= 0x20 && current != '"' && current != '\\') continue;
+        emit(context, run, c - run);
+        char escape[6] = {'\\', (char)current};
+        if(current < 0x20) {
+            memcpy(escape, "\\u00", 4);
+            escape[4] = hex[current >> 4];
+            escape[5] = hex[current & 0xF];
+            emit(context, escape, 6);
+        } else {
+            emit(context, escape, 2);
+        }
+        run = c + 1;
+    }
+    emit(context, run, strlen(run));
+    emit(context, "\"", 1);
+}
+
+size_t format_canonical_number(double number, char* buffer, size_t size) {
+    if(number != number || number > DBL_MAX || number < -DBL_MAX) return snprintf(buffer, size, "null");
+    if(number > -9007199254740992.0 && number < 9007199254740992.0 && number == (double)(int64_t)number) {
+        return snprintf(buffer, size, "%" PRId64, (int64_t)number);
+    }
+    int length = 0;
+    for(int precision = 1; precision <= 17; precision++) {
+        length = snprintf(buffer, size, "%.*g", precision, number);
+        if(strtod(buffer, NULL) == number) break;
+    }
+    return length;
+}
+
+// sign, significant digits and decimal exponent of a JSON number such as
+// "-1234e-2", different spellings of the same value normalize alike.
+// buffer holds at least length + 32 bytes
+size_t normalize_number_text(const char* text, size_t length, char* buffer) {
+    const char* c = text;
+    const char* end = text + length;
+    size_t count = 0;
+    if(c < end && *c == '-') {
+        buffer[count++] = '-';
+        c++;
+    }
+    size_t first_digit = count;
+    int64_t exponent = 0;
+    for(; c < end && isdigit((unsigned char)*c); c++) {
+        if(count == first_digit && *c == '0') continue;
+        buffer[count++] = *c;
+    }
+    if(c < end && *c == '.') {
+        for(c++; c < end && isdigit((unsigned char)*c); c++) {
+            exponent--;
+            if(count == first_digit && *c == '0') continue;
+            buffer[count++] = *c;
+        }
+    }
+    if(c < end && (*c == 'e' || *c == 'E')) {
+        c++;
+        bool negative = c < end && *c == '-';
+        if(c < end && (*c == '-' || *c == '+')) c++;
+        int64_t value = 0;
+        for(; c < end && isdigit((unsigned char)*c); c++) {
+            if(value < INT64_MAX/100) value = value*10 + (*c - '0');
+        }
+        exponent += negative ? -value : value;
+    }
+    while(count > first_digit && buffer[count-1] == '0') {
+        count--;
+        exponent++;
+    }
+    if(count == first_digit) {
+        buffer[0] = '0';
+        return 1;
+    }
+    if(exponent != 0) count += sprintf(&buffer[count], "e%" PRId64, exponent);
+    return count;
+}
+
+// canonical text of a number: the double form, unless the source digits
+// hold a value the double does not represent exactly, then their
+// normalized form so that such numbers neither hash nor compare equal
+const char* canonical_number(arena_t* scratch, const JsonValue* json_value, char* double_buf, size_t size, size_t* length) {
+    double number = json_number(json_value);
+    *length = format_canonical_number(number, double_buf, size);
+    if(json_value->type != RAW_NUMBER) return double_buf;
+
+    char* normalized = arena_malloc(scratch, json_value->number_length + 32);
+    if(normalized == NULL) return NULL;
+    size_t normalized_length = normalize_number_text(json_value->number_text, json_value->number_length, normalized);
+    if(number == number && number <= DBL_MAX && number >= -DBL_MAX) {
+        char double_normalized[64 + 32];
+        size_t double_length = normalize_number_text(double_buf, *length, double_normalized);
+        if(double_length == normalized_length && !memcmp(double_normalized, normalized, normalized_length)) return double_buf;
+    }
+    *length = normalized_length;
+    return normalized;
+}
+
+int compare_element_names(const void* a, const void* b) {
+    const JsonElement* element_a = *(const JsonElement* const*)a;
+    const JsonElement* element_b = *(const JsonElement* const*)b;
+    int result = strcmp(element_a->name, element_b->name);
+    if(result != 0) return result;
+    return (element_a < element_b) ? -1 : (element_a > element_b);
+}
+
+// live elements of json_object sorted by name, allocated from scratch
+const JsonElement** sorted_elements(arena_t* scratch, const JsonObject* json_object, size_t* count) {
+    *count = 0;
+    if(json_object->count == 0) return NULL;
+    const JsonElement** elements = arena_malloc(scratch, json_object->count*sizeof(JsonElement*));
+    if(elements == NULL) return NULL;
+    for(size_t i = 0; i < json_object->count; i++) {
+        if(json_object->items[i].name != NULL) elements[(*count)++] = &json_object->items[i];
+    }
+    qsort(elements, *count, sizeof(JsonElement*), compare_element_names);
+    return elements;
+}
+
+void canonical_object(CanonicalSink* sink, const JsonObject* json_object);
+
+void canonical_value(CanonicalSink* sink, const JsonValue* json_value) {
+    char double_buf[64];
+    size_t length;
+    switch (json_value->type) {
+        case OBJECT:
+            canonical_object(sink, &json_value->object);
+            break;
+        case ARRAY:
+            canonical_emit(sink, "[", 1);
+            for(size_t i = 0; i < json_value->array.count; i++) {
+                if(i > 0) canonical_emit(sink, ",", 1);
+                canonical_value(sink, &json_value->array.items[i]);
+            }
+            canonical_emit(sink, "]", 1);
+            break;
+        case STRING:
+            emit_quoted(json_value->string, canonical_sink_emit, sink);
+            break;
+        case NUMBER:
+        case RAW_NUMBER: {
+            const char* number = canonical_number(&sink->scratch, json_value, double_buf, sizeof(double_buf), &length);
+            if(number != NULL) canonical_emit(sink, number, length);
+            break;
+        }
+        case BOOLEAN:
+            if(json_value->boolean) {
+                canonical_emit(sink, "true", 4);
+            } else {
+                canonical_emit(sink, "false", 5);
+            }
+            break;
+        case NILL:
+            canonical_emit(sink, "null", 4);
+            break;
+    }
+}
+
+void canonical_object(CanonicalSink* sink, const JsonObject* json_object) {
+    size_t count;
+    const JsonElement** elements = sorted_elements(&sink->scratch, json_object, &count);
+    canonical_emit(sink, "{", 1);
+    for(size_t i = 0; i < count; i++) {
+        if(i > 0) canonical_emit(sink, ",", 1);
+        emit_quoted(elements[i]->name, canonical_sink_emit, sink);
+        canonical_emit(sink, ":", 1);
+        canonical_value(sink, &elements[i]->value);
+    }
+    canonical_emit(sink, "}", 1);
+}
+
+char* write_json_canonical(const JsonObject* json_object) {
+    StringBuilder sb = {0};
+    CanonicalSink sink = {.sb = &sb, .scratch.provider = arena.provider};
+    canonical_object(&sink, json_object);
+    arena_free(&sink.scratch);
+    arena_da_append(&arena, &sb, '\0');
+    return (arena.out_of_memory || sink.scratch.out_of_memory) ? NULL : sb.items;
+}
+
+bool json_hash(const JsonObject* json_object, uint64_t* hash) {
+    CanonicalSink sink = {.hash = FNV_OFFSET_BASIS, .scratch.provider = arena.provider};
+    canonical_object(&sink, json_object);
+    arena_free(&sink.scratch);
+    if(sink.scratch.out_of_memory) return false;
+    *hash = sink.hash;
+    return true;
+}
+
+bool equal_object(arena_t* scratch, const JsonObject* a, const JsonObject* b);
+
+bool is_number(const JsonValue* json_value) {
+    return json_value->type == NUMBER || json_value->type == RAW_NUMBER;
+}
+
+bool equal_value(arena_t* scratch, const JsonValue* a, const JsonValue* b) {
+    if(a->type != b->type && !(is_number(a) && is_number(b))) return false;
+    switch (a->type) {
+        case OBJECT:
+            return equal_object(scratch, &a->object, &b->object);
+        case ARRAY:
+            if(a->array.count != b->array.count) return false;
+            for(size_t i = 0; i < a->array.count; i++) {
+                if(!equal_value(scratch, &a->array.items[i], &b->array.items[i])) return false;
+            }
+            return true;
+        case STRING:
+            return !strcmp(a->string, b->string);
+        case NUMBER:
+        case RAW_NUMBER: {
+            if(a->type == RAW_NUMBER || b->type == RAW_NUMBER) {
+                char double_buf_a[64];
+                char double_buf_b[64];
+                size_t length_a;
+                size_t length_b;
+                const char* number_text_a = canonical_number(scratch, a, double_buf_a, sizeof(double_buf_a), &length_a);
+                const char* number_text_b = canonical_number(scratch, b, double_buf_b, sizeof(double_buf_b), &length_b);
+                if(number_text_a == NULL || number_text_b == NULL) return false;
+                return length_a == length_b && !memcmp(number_text_a, number_text_b, length_a);
+            }
+            double number_a = json_number(a);
+            double number_b = json_number(b);
+            // NaN and infinities are all written as null
+            if(number_a != number_a || number_a > DBL_MAX || number_a < -DBL_MAX) {
+                return number_b != number_b || number_b > DBL_MAX || number_b < -DBL_MAX;
+            }
+            return number_a == number_b;
+        }
+        case BOOLEAN:
+            return a->boolean == b->boolean;
+        case NILL:
+            return true;
+    }
+    return false;
+}
+
+bool equal_object(arena_t* scratch, const JsonObject* a, const JsonObject* b) {
+    size_t count_a = a->count - ((a->index != NULL) ? a->index->removed : 0);
+    size_t count_b = b->count - ((b->index != NULL) ? b->index->removed : 0);
+    if(count_a != count_b) return false;
+
+    const JsonElement** elements_a = sorted_elements(scratch, a, &count_a);
+    const JsonElement** elements_b = sorted_elements(scratch, b, &count_b);
+    for(size_t i = 0; i < count_a; i++) {
+        if(strcmp(elements_a[i]->name, elements_b[i]->name)) return false;
+        if(!equal_value(scratch, &elements_a[i]->value, &elements_b[i]->value)) return false;
+    }
+    return true;
+}
+
+bool json_equal(const JsonObject* a, const JsonObject* b) {
+    arena_t scratch = {.provider = arena.provider};
+    bool result = equal_object(&scratch, a, b) && !scratch.out_of_memory;
+    arena_free(&scratch);
+    return result;
+}
+
+double json_number(const JsonValue* json_value) {
+    if(json_value->type != RAW_NUMBER) return json_value->number;
+    // the view is followed by a character that ends the number
+    return strtod(json_value->number_text, NULL);
+}
+
+bool json_number_int64(const JsonValue* json_value, int64_t* number) {
+    if(json_value->type != RAW_NUMBER) {
+        double value = json_value->number;
+        if(!(value >= -9223372036854775808.0 && value < 9223372036854775808.0)) return false;
+        if(value != (double)(int64_t)value) return false;
+        *number = (int64_t)value;
+        return true;
+    }
+
+    const char* c = json_value->number_text;
+    const char* end = c + json_value->number_length;
+    bool negative = *c == '-';
+    if(negative) c++;
+    uint64_t magnitude = 0;
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    for(; c < end; c++) {
+        if(!isdigit((unsigned char)*c)) break;
+        unsigned digit = *c - '0';
+        if(magnitude > (limit - digit)/10) return false;
+        magnitude = magnitude*10 + digit;
+    }
+    // fractions and exponents go through the double conversion
+    if(c != end) return json_number_int64(&(JsonValue){.type = NUMBER, .number = json_number(json_value)}, number);
+    *number = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+    return true;
+}
+
+const char* json_number_text(const JsonValue* json_value, size_t* length) {
+    if(json_value->type == RAW_NUMBER) {
+        *length = json_value->number_length;
+        return json_value->number_text;
+    }
+    char double_buf[64];
+    *length = format_canonical_number(json_value->number, double_buf, sizeof(double_buf));
+    return arena_strdup(&arena, double_buf);
+}
+
+void json_set_number(JsonValue* json_value, double number) {
+    json_value->type = NUMBER;
+    json_value->number = number;
+}
+
+uint64_t hash_name(const char* name) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for(const unsigned char* c = (const unsigned char*)name; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// every occurrence of a duplicated name is indexed, the lookup returns the
+// first one like the linear search so removing it uncovers the next
+size_t* index_find_slot(const JsonObject* json_object, const char* name) {
+    JsonObjectIndex* index = json_object->index;
+    size_t mask = index->capacity - 1;
+    size_t* found = NULL;
+    for(size_t slot = hash_name(name) & mask;; slot = (slot + 1) & mask) {
+        size_t entry = index->slots[slot];
+        if(entry == 0) return found;
+        if(entry != INDEX_DELETED_SLOT && !strcmp(json_object->items[entry-1].name, name)) {
+            if(found == NULL || entry < *found) found = &index->slots[slot];
+        }
+    }
+}
+
+void index_insert(JsonObject* json_object, size_t position) {
+    JsonObjectIndex* index = json_object->index;
+    const char* name = json_object->items[position].name;
+    size_t mask = index->capacity - 1;
+    size_t slot = hash_name(name) & mask;
+    while(index->slots[slot] != 0 && index->slots[slot] != INDEX_DELETED_SLOT) slot = (slot + 1) & mask;
+    if(index->slots[slot] == 0) index->used++;
+    index->slots[slot] = position + 1;
+}
+
+void object_build_index(JsonObject* json_object) {
+    size_t capacity = 2*INDEX_MIN_COUNT;
+    while(capacity < 2*json_object->count) capacity *= 2;
+    json_object->index = NULL;
+    JsonObjectIndex* index = arena_calloc(&arena, 1, sizeof(JsonObjectIndex) + capacity*sizeof(size_t));
+    if(index == NULL) return;
+    index->capacity = capacity;
+    json_object->index = index;
     for(size_t i = 0; i < json_object->count; i++) {
-        JsonElement* json_element = &json_object->items[i];
-        if(!strcmp(json_element->name, name)) return &json_element->value;
+        if(json_object->items[i].name != NULL) index_insert(json_object, i);
     }
-    return NULL;
+}
+
+// drops the removed elements, keeping the order of the others
+void object_compact_removed(JsonObject* json_object) {
+    size_t count = 0;
+    for(size_t i = 0; i < json_object->count; i++) {
+        if(json_object->items[i].name != NULL) json_object->items[count++] = json_object->items[i];
+    }
+    json_object->count = count;
+    object_build_index(json_object);
+}
+
+void object_append_element(JsonObject* json_object, JsonElement json_element) {
+    arena_da_append(&arena, json_object, json_element);
+    if(json_object->index == NULL) return;
+    if(4*(json_object->index->used + 1) > 3*json_object->index->capacity) {
+        object_compact_removed(json_object);
+    } else {
+        index_insert(json_object, json_object->count - 1);
+    }
+}
+
+size_t object_find(const JsonObject* json_object, const char* name) {
+    if(json_object->index != NULL) {
+        size_t* slot = index_find_slot(json_object, name);
+        return (slot == NULL) ? json_object->count : *slot - 1;
+    }
+    for(size_t i = 0; i < json_object->count; i++) {
+        if(json_object->items[i].name != NULL && !strcmp(json_object->items[i].name, name)) return i;
+    }
+    return json_object->count;
+}
+
+const JsonValue* get_by_name(const JsonObject* json_object, const char* name) {
+    size_t position = object_find(json_object, name);
+    if(position == json_object->count) return NULL;
+    return &json_object->items[position].value;
 }
 
 void object_add_string(JsonObject* json_object, const char* name, const char* value) {
+    mark_source_modified(json_object->source);
     JsonElement json_element = {0};
     json_element.name = arena_strdup(&arena,name);
     json_element.value.type = STRING;
     json_element.value.string = arena_strdup(&arena, value);
-    arena_da_append(&arena, json_object, json_element);
+    object_append_element(json_object, json_element);
 }
 
 void object_add_number(JsonObject* json_object, const char* name, double number) {
+    mark_source_modified(json_object->source);
     JsonElement json_element = {0};
     json_element.name = arena_strdup(&arena,name);
     json_element.value.type = NUMBER;
     json_element.value.number = number;
-    arena_da_append(&arena, json_object, json_element);
+    object_append_element(json_object, json_element);
 }
 
 void object_add_boolean(JsonObject* json_object, const char* name, bool boolean) {
+    mark_source_modified(json_object->source);
     JsonElement json_element = {0};
     json_element.name = arena_strdup(&arena,name);
     json_element.value.type = BOOLEAN;
     json_element.value.boolean = boolean;
-    arena_da_append(&arena, json_object, json_element);
+    object_append_element(json_object, json_element);
 }
 
 void object_add_null(JsonObject* json_object, const char* name) {
+    mark_source_modified(json_object->source);
     JsonElement json_element = {0};
     json_element.name = arena_strdup(&arena,name);
     json_element.value.type = NILL;
     json_element.value.nill = NULL;
-    arena_da_append(&arena, json_object, json_element);
+    object_append_element(json_object, json_element);
 }
 
 void object_add_object(JsonObject* json_object, const char* name, JsonObject value) {
+    mark_source_modified(json_object->source);
     JsonElement json_element = {0};
     json_element.name = arena_strdup(&arena,name);
     json_element.value.type = OBJECT;
     json_element.value.object = value;
-    arena_da_append(&arena, json_object, json_element);
+    object_append_element(json_object, json_element);
 }
 
 void object_add_array(JsonObject* json_object, const char* name, JsonArray value) {
+    mark_source_modified(json_object->source);
     JsonElement json_element = {0};
     json_element.name = arena_strdup(&arena,name);
     json_element.value.type = ARRAY;
     json_element.value.array = value;
-    arena_da_append(&arena, json_object, json_element);
+    object_append_element(json_object, json_element);
 }
 
 void array_add_string(JsonArray* json_array, const char* value) {
+    mark_source_modified(json_array->source);
     JsonValue json_value = {0};
     json_value.type = STRING;
     json_value.string = arena_strdup(&arena, value);
@@ -626,6 +1321,7 @@ void array_add_string(JsonArray* json_array, const char* value) {
 }
 
 void array_add_number(JsonArray* json_array, double number) {
+    mark_source_modified(json_array->source);
     JsonValue json_value = {0};
     json_value.type = NUMBER;
     json_value.number = number;
@@ -633,6 +1329,7 @@ void array_add_number(JsonArray* json_array, double number) {
 }
 
 void array_add_boolean(JsonArray* json_array, bool boolean) {
+    mark_source_modified(json_array->source);
     JsonValue json_value = {0};
     json_value.type = BOOLEAN;
     json_value.boolean = boolean;
@@ -640,6 +1337,7 @@ void array_add_boolean(JsonArray* json_array, bool boolean) {
 }
 
 void array_add_null(JsonArray* json_array) {
+    mark_source_modified(json_array->source);
     JsonValue json_value = {0};
     json_value.type = NILL;
     json_value.nill = NULL;
@@ -647,6 +1345,7 @@ void array_add_null(JsonArray* json_array) {
 }
 
 void array_add_object(JsonArray* json_array, JsonObject value) {
+    mark_source_modified(json_array->source);
     JsonValue json_value = {0};
     json_value.type = OBJECT;
     json_value.object = value;
@@ -654,12 +1353,593 @@ void array_add_object(JsonArray* json_array, JsonObject value) {
 }
 
 void array_add_array(JsonArray* json_array, JsonArray value) {
+    mark_source_modified(json_array->source);
     JsonValue json_value = {0};
     json_value.type = ARRAY;
     json_value.array = value;
     arena_da_append(&arena, json_array, json_value);
 }
 
+void* clone_reserve(CloneBlock* block, size_t size, size_t alignment) {
+    block->size = (block->size + alignment - 1) & ~(alignment - 1);
+    void* ptr = (block->data == NULL) ? NULL : block->data + block->size;
+    block->size += size;
+    return ptr;
+}
+
+char* clone_string(CloneBlock* block, const char* string) {
+    size_t length = strlen(string) + 1;
+    char* copy = clone_reserve(block, length, 1);
+    if(copy != NULL) memcpy(copy, string, length);
+    return copy;
+}
+
+JsonObject clone_object(CloneBlock* block, const JsonObject* json_object);
+JsonArray clone_array(CloneBlock* block, const JsonArray* json_array);
+
+JsonValue clone_value(CloneBlock* block, const JsonValue* json_value) {
+    JsonValue copy = *json_value;
+    switch (json_value->type) {
+        case OBJECT:
+            copy.object = clone_object(block, &json_value->object);
+            break;
+        case ARRAY:
+            copy.array = clone_array(block, &json_value->array);
+            break;
+        case STRING:
+            copy.string = clone_string(block, json_value->string);
+            break;
+        case RAW_NUMBER: {
+            // terminated so json_number can convert the copy in place
+            char* number_text = clone_reserve(block, json_value->number_length + 1, 1);
+            if(number_text != NULL) {
+                memcpy(number_text, json_value->number_text, json_value->number_length);
+                number_text[json_value->number_length] = '\0';
+            }
+            copy.number_text = number_text;
+            break;
+        }
+        default:
+            break;
+    }
+    return copy;
+}
+
+JsonArray clone_array(CloneBlock* block, const JsonArray* json_array) {
+    JsonArray copy = {0};
+    if(json_array->count == 0) return copy;
+    copy.items = clone_reserve(block, json_array->count*sizeof(JsonValue), _Alignof(JsonValue));
+    copy.capacity = json_array->count;
+    copy.count = json_array->count;
+    for(size_t i = 0; i < json_array->count; i++) {
+        JsonValue json_value = clone_value(block, &json_array->items[i]);
+        if(copy.items != NULL) copy.items[i] = json_value;
+    }
+    return copy;
+}
+
+JsonObject clone_object(CloneBlock* block, const JsonObject* json_object) {
+    JsonObject copy = {0};
+    size_t count = json_object->count;
+    if(json_object->index != NULL) count -= json_object->index->removed;
+    if(count == 0) return copy;
+    copy.items = clone_reserve(block, count*sizeof(JsonElement), _Alignof(JsonElement));
+    copy.capacity = count;
+    for(size_t i = 0; i < json_object->count; i++) {
+        if(json_object->items[i].name == NULL) continue;
+        JsonElement json_element = {0};
+        json_element.name = clone_string(block, json_object->items[i].name);
+        json_element.value = clone_value(block, &json_object->items[i].value);
+        if(copy.items != NULL) copy.items[copy.count] = json_element;
+        copy.count++;
+    }
+    return copy;
+}
+
+JsonObject json_clone(arena_t* ctx, const JsonObject* json_object) {
+    CloneBlock block = {0};
+    clone_object(&block, json_object);
+    if(block.size == 0) return (JsonObject){0};
+
+    // arena allocations are not aligned, the measure pass assumed an aligned base
+    size_t alignment = _Alignof(max_align_t);
+    char* data = arena_malloc(ctx, block.size + alignment - 1);
+    if(data == NULL) return (JsonObject){0};
+    block.data = (char*)(((uintptr_t)data + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    block.size = 0;
+    return clone_object(&block, json_object);
+}
+
+void object_set_value(JsonObject* json_object, const char* name, JsonValue json_value) {
+    mark_source_modified(json_object->source);
+    if(json_object->index == NULL && json_object->count >= INDEX_MIN_COUNT) object_build_index(json_object);
+
+    size_t position = object_find(json_object, name);
+    if(position < json_object->count) {
+        json_object->items[position].value = json_value;
+        return;
+    }
+
+    JsonElement json_element = {0};
+    json_element.name = arena_strdup(&arena, name);
+    json_element.value = json_value;
+    object_append_element(json_object, json_element);
+}
+
+void object_set_string(JsonObject* json_object, const char* name, const char* value) {
+    JsonValue json_value = {0};
+    json_value.type = STRING;
+    json_value.string = arena_strdup(&arena, value);
+    object_set_value(json_object, name, json_value);
+}
+
+void object_set_number(JsonObject* json_object, const char* name, double number) {
+    JsonValue json_value = {0};
+    json_value.type = NUMBER;
+    json_value.number = number;
+    object_set_value(json_object, name, json_value);
+}
+
+void object_set_boolean(JsonObject* json_object, const char* name, bool boolean) {
+    JsonValue json_value = {0};
+    json_value.type = BOOLEAN;
+    json_value.boolean = boolean;
+    object_set_value(json_object, name, json_value);
+}
+
+void object_set_null(JsonObject* json_object, const char* name) {
+    JsonValue json_value = {0};
+    json_value.type = NILL;
+    json_value.nill = NULL;
+    object_set_value(json_object, name, json_value);
+}
+
+void object_set_object(JsonObject* json_object, const char* name, JsonObject value) {
+    JsonValue json_value = {0};
+    json_value.type = OBJECT;
+    json_value.object = value;
+    object_set_value(json_object, name, json_value);
+}
+
+void object_set_array(JsonObject* json_object, const char* name, JsonArray value) {
+    JsonValue json_value = {0};
+    json_value.type = ARRAY;
+    json_value.array = value;
+    object_set_value(json_object, name, json_value);
+}
+
+bool object_remove(JsonObject* json_object, const char* name) {
+    if(json_object->index == NULL && json_object->count >= INDEX_MIN_COUNT) object_build_index(json_object);
+
+    size_t position = object_find(json_object, name);
+    if(position == json_object->count) return false;
+    mark_source_modified(json_object->source);
+
+    JsonObjectIndex* index = json_object->index;
+    if(index == NULL) {
+        memmove(&json_object->items[position], &json_object->items[position+1], (json_object->count-1-position)*sizeof(JsonElement));
+        json_object->count--;
+        return true;
+    }
+
+    *index_find_slot(json_object, name) = INDEX_DELETED_SLOT;
+    if(position == json_object->count - 1) {
+        json_object->count--;
+        return true;
+    }
+    json_object->items[position].name = NULL;
+    index->removed++;
+    if(2*index->removed > json_object->count) object_compact_removed(json_object);
+    return true;
+}
+
+bool array_insert(JsonArray* json_array, size_t position, JsonValue value) {
+    if(position > json_array->count) return false;
+    size_t count = json_array->count;
+    arena_da_append(&arena, json_array, value);
+    if(json_array->count == count) return false;
+    mark_source_modified(json_array->source);
+    memmove(&json_array->items[position+1], &json_array->items[position], (json_array->count-1-position)*sizeof(JsonValue));
+    json_array->items[position] = value;
+    return true;
+}
+
+bool array_remove(JsonArray* json_array, size_t position) {
+    if(position >= json_array->count) return false;
+    mark_source_modified(json_array->source);
+    memmove(&json_array->items[position], &json_array->items[position+1], (json_array->count-1-position)*sizeof(JsonValue));
+    json_array->count--;
+    return true;
+}
+
+// records usually share their key order, so the slot a field had in the
+// previous record is checked before searching the object
+const JsonValue* find_column_value(const JsonObject* record, const char* name, size_t* slot) {
+    if(*slot < record->count && record->items[*slot].name != NULL && !strcmp(record->items[*slot].name, name)) {
+        return &record->items[*slot].value;
+    }
+    size_t position = object_find(record, name);
+    if(position == record->count) return NULL;
+    *slot = position;
+    return &record->items[position].value;
+}
+
+void allocate_column(JsonColumn* column, size_t count) {
+    column->nulls = arena_calloc(&arena, (count + 7)/8, sizeof(uint8_t));
+    switch (column->type) {
+        case COLUMN_NUMBER:
+            column->numbers = arena_calloc(&arena, count, sizeof(double));
+            break;
+        case COLUMN_INT64:
+            column->integers = arena_calloc(&arena, count, sizeof(int64_t));
+            break;
+        case COLUMN_STRING:
+            column->offsets = arena_calloc(&arena, count + 1, sizeof(size_t));
+            break;
+        case COLUMN_BOOLEAN:
+            column->booleans = arena_calloc(&arena, count, sizeof(bool));
+            break;
+    }
+}
+
+bool store_column_value(JsonColumn* column, StringBuilder* data, size_t row, const JsonValue* json_value) {
+    switch (column->type) {
+        case COLUMN_NUMBER:
+            if(!is_number(json_value)) return false;
+            column->numbers[row] = json_number(json_value);
+            return true;
+        case COLUMN_INT64:
+            if(!is_number(json_value)) return false;
+            return json_number_int64(json_value, &column->integers[row]);
+        case COLUMN_STRING:
+            if(json_value->type != STRING) return false;
+            sb_append(data, json_value->string);
+            return true;
+        case COLUMN_BOOLEAN:
+            if(json_value->type != BOOLEAN) return false;
+            column->booleans[row] = json_value->boolean;
+            return true;
+    }
+    return false;
+}
+
+size_t extract_columns(const JsonArray* records, JsonColumn* columns, size_t column_count) {
+    size_t count = records->count;
+    if(count == 0 || column_count == 0) return count;
+
+    arena_t scratch = {.provider = arena.provider};
+    size_t* slots = arena_calloc(&scratch, column_count, sizeof(size_t));
+    StringBuilder* data = arena_calloc(&scratch, column_count, sizeof(StringBuilder));
+    for(size_t c = 0; c < column_count; c++) allocate_column(&columns[c], count);
+    if(scratch.out_of_memory || arena.out_of_memory) {
+        arena_free(&scratch);
+        return 0;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        const JsonValue* record = &records->items[i];
+        for(size_t c = 0; c < column_count; c++) {
+            JsonColumn* column = &columns[c];
+            const JsonValue* json_value = NULL;
+            if(record->type == OBJECT) json_value = find_column_value(&record->object, column->name, &slots[c]);
+            if(json_value == NULL || !store_column_value(column, &data[c], i, json_value)) {
+                column->nulls[i/8] |= (uint8_t)(1 << (i%8));
+            }
+            if(column->type == COLUMN_STRING) column->offsets[i+1] = data[c].count;
+        }
+    }
+
+    for(size_t c = 0; c < column_count; c++) {
+        if(columns[c].type == COLUMN_STRING) columns[c].data = data[c].items;
+    }
+    arena_free(&scratch);
+    return arena.out_of_memory ? 0 : count;
+}
+
+JsonOutput json_output_buffer(char* data, size_t capacity) {
+    return (JsonOutput){.data = data, .capacity = capacity, .fd = -1};
+}
+
+JsonOutput json_output_fd(int fd, char* data, size_t capacity) {
+    return (JsonOutput){.data = data, .capacity = capacity, .fd = fd};
+}
+
+bool write_all(int fd, const char* data, size_t length) {
+    while(length > 0) {
+        ssize_t written = write(fd, data, length);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool json_output_flush(JsonOutput* output) {
+    if(output->failed) return false;
+    if(output->fd < 0 || output->count == 0) return true;
+    if(!write_all(output->fd, output->data, output->count)) output->failed = true;
+    output->count = 0;
+    return !output->failed;
+}
+
+bool json_output_write(JsonOutput* output, const char* data, size_t length) {
+    if(output->failed) return false;
+    if(output->count + length > output->capacity) {
+        if(output->fd < 0) {
+            output->failed = true;
+            return false;
+        }
+        if(!json_output_flush(output)) return false;
+        if(length > output->capacity) {
+            if(!write_all(output->fd, data, length)) output->failed = true;
+            return !output->failed;
+        }
+    }
+    memcpy(&output->data[output->count], data, length);
+    output->count += length;
+    return true;
+}
+
+JsonWriter json_writer(JsonOutput* output) {
+    return (JsonWriter){.output = output};
+}
+
+// a value is either the root, an array item or follows a key
+void writer_begin_value(JsonWriter* writer) {
+    assert(writer->depth == 0 || !writer->in_object[writer->depth-1] || writer->after_key);
+    if(writer->need_comma && !writer->after_key) json_output_write(writer->output, ",", 1);
+    writer->after_key = false;
+    writer->need_comma = true;
+}
+
+void writer_open(JsonWriter* writer, const char* bracket, bool is_object) {
+    writer_begin_value(writer);
+    // deeper output is valid JSON, so it fails the output rather than asserting
+    if(writer->depth >= JSON_WRITER_MAX_DEPTH) {
+        writer->output->failed = true;
+        return;
+    }
+    writer->in_object[writer->depth++] = is_object;
+    writer->need_comma = false;
+    json_output_write(writer->output, bracket, 1);
+}
+
+void writer_close(JsonWriter* writer, const char* bracket, bool is_object) {
+    assert(writer->depth > 0 && writer->in_object[writer->depth-1] == is_object && !writer->after_key);
+    (void)is_object;
+    if(writer->depth == 0) {
+        writer->output->failed = true;
+        return;
+    }
+    writer->depth--;
+    writer->need_comma = true;
+    json_output_write(writer->output, bracket, 1);
+}
+
+void json_writer_begin_object(JsonWriter* writer) {
+    writer_open(writer, "{", true);
+}
+
+void json_writer_end_object(JsonWriter* writer) {
+    writer_close(writer, "}", true);
+}
+
+void json_writer_begin_array(JsonWriter* writer) {
+    writer_open(writer, "[", false);
+}
+
+void json_writer_end_array(JsonWriter* writer) {
+    writer_close(writer, "]", false);
+}
+
+void output_emit(void* output, const char* data, size_t length) {
+    json_output_write(output, data, length);
+}
+
+void writer_quoted(JsonWriter* writer, const char* string) {
+    emit_quoted(string, output_emit, writer->output);
+}
+
+void json_writer_key(JsonWriter* writer, const char* name) {
+    assert(writer->depth > 0 && writer->in_object[writer->depth-1] && !writer->after_key);
+    if(writer->need_comma) json_output_write(writer->output, ",", 1);
+    writer_quoted(writer, name);
+    json_output_write(writer->output, ":", 1);
+    writer->after_key = true;
+}
+
+void json_writer_string(JsonWriter* writer, const char* value) {
+    writer_begin_value(writer);
+    writer_quoted(writer, value);
+}
+
+void json_writer_number(JsonWriter* writer, double number) {
+    char double_buf[64];
+    writer_begin_value(writer);
+    size_t length = format_canonical_number(number, double_buf, sizeof(double_buf));
+    json_output_write(writer->output, double_buf, length);
+}
+
+void json_writer_int64(JsonWriter* writer, int64_t number) {
+    char int_buf[24];
+    writer_begin_value(writer);
+    int length = snprintf(int_buf, sizeof(int_buf), "%" PRId64, number);
+    json_output_write(writer->output, int_buf, length);
+}
+
+void json_writer_boolean(JsonWriter* writer, bool boolean) {
+    writer_begin_value(writer);
+    if(boolean) {
+        json_output_write(writer->output, "true", 4);
+    } else {
+        json_output_write(writer->output, "false", 5);
+    }
+}
+
+void json_writer_null(JsonWriter* writer) {
+    writer_begin_value(writer);
+    json_output_write(writer->output, "null", 4);
+}
+
+bool json_writer_finish(JsonWriter* writer) {
+    assert(writer->depth == 0 && !writer->after_key);
+    return json_output_flush(writer->output);
+}
+
+// walks the text without building values, copying every token to output
+// when there is one
+typedef struct {
+    const char* cursor;
+    int flags;
+    JsonOutput* output;
+    size_t depth;
+} JsonScanner;
+
+#define SCANNER_MAX_DEPTH 1024
+
+bool scanner_emit(JsonScanner* scanner, const char* end) {
+    bool result = true;
+    if(scanner->output != NULL) result = json_output_write(scanner->output, scanner->cursor, end - scanner->cursor);
+    scanner->cursor = end;
+    return result;
+}
+
+bool scanner_expect(JsonScanner* scanner, char expected) {
+    skip_space(&scanner->cursor);
+    if(*scanner->cursor != expected) return false;
+    return scanner_emit(scanner, scanner->cursor + 1);
+}
+
+bool scan_object(JsonScanner* scanner);
+bool scan_array(JsonScanner* scanner);
+
+bool scan_string(JsonScanner* scanner) {
+    skip_space(&scanner->cursor);
+    const char* start = scanner->cursor;
+    if(*start != '"') return false;
+    const char* end = strchr(start + 1, '"');
+    if(end == NULL) return false;
+    size_t invalid_offset;
+    if((scanner->flags & JSON_PARSE_VALIDATE_UTF8) && !validate_utf8(start + 1, end - (start + 1), &invalid_offset)) {
+        scanner->cursor = start + 1 + invalid_offset;
+        return false;
+    }
+    return scanner_emit(scanner, end + 1);
+}
+
+bool scan_value(JsonScanner* scanner) {
+    skip_space(&scanner->cursor);
+    const char* start = scanner->cursor;
+    switch (*start) {
+        case '{':
+            return scan_object(scanner);
+        case '[':
+            return scan_array(scanner);
+        case '"':
+            return scan_string(scanner);
+        case 't':
+            return !strncmp(start, "true", 4) && scanner_emit(scanner, start + 4);
+        case 'f':
+            return !strncmp(start, "false", 5) && scanner_emit(scanner, start + 5);
+        case 'n':
+            return !strncmp(start, "null", 4) && scanner_emit(scanner, start + 4);
+        default: {
+            const char* end = scan_number(start);
+            return end != start && scanner_emit(scanner, end);
+        }
+    }
+}
+
+bool scan_array(JsonScanner* scanner) {
+    if(scanner->depth++ >= SCANNER_MAX_DEPTH) return false;
+    if(!scanner_expect(scanner, '[')) return false;
+    skip_space(&scanner->cursor);
+    if(*scanner->cursor != ']') {
+        if(!scan_value(scanner)) return false;
+        skip_space(&scanner->cursor);
+        while(*scanner->cursor == ',') {
+            if(!scanner_emit(scanner, scanner->cursor + 1)) return false;
+            if(!scan_value(scanner)) return false;
+            skip_space(&scanner->cursor);
+        }
+    }
+    if(!scanner_expect(scanner, ']')) return false;
+    scanner->depth--;
+    return true;
+}
+
+bool scan_element(JsonScanner* scanner) {
+    return scan_string(scanner) && scanner_expect(scanner, ':') && scan_value(scanner);
+}
+
+bool scan_object(JsonScanner* scanner) {
+    if(scanner->depth++ >= SCANNER_MAX_DEPTH) return false;
+    if(!scanner_expect(scanner, '{')) return false;
+    skip_space(&scanner->cursor);
+    if(*scanner->cursor != '}') {
+        if(!scan_element(scanner)) return false;
+        skip_space(&scanner->cursor);
+        while(*scanner->cursor == ',') {
+            if(!scanner_emit(scanner, scanner->cursor + 1)) return false;
+            if(!scan_element(scanner)) return false;
+            skip_space(&scanner->cursor);
+        }
+    }
+    if(!scanner_expect(scanner, '}')) return false;
+    scanner->depth--;
+    return true;
+}
+
+bool scan_json_string(const char* json_string, int flags, JsonOutput* output, size_t* error_offset) {
+    JsonScanner scanner = {
+        .cursor = json_string,
+        .flags = flags,
+        .output = output
+    };
+    bool valid = scan_object(&scanner);
+    if(valid) {
+        skip_space(&scanner.cursor);
+        valid = *scanner.cursor == '\0';
+    }
+    if(!valid && error_offset != NULL) *error_offset = scanner.cursor - json_string;
+    return valid;
+}
+
+bool json_validate(const char* json_string, int flags, size_t* error_offset) {
+    return scan_json_string(json_string, flags, NULL, error_offset);
+}
+
+bool json_minify(const char* json_string, int flags, JsonOutput* output, size_t* error_offset) {
+    // flushed bytes cannot be taken back, so nothing reaches the fd before
+    // the whole text is known to be valid
+    if(output->fd >= 0 && !scan_json_string(json_string, flags, NULL, error_offset)) return false;
+    return scan_json_string(json_string, flags, output, error_offset) && json_output_flush(output);
+}
+
+void object_mark_modified(const JsonObject* json_object) {
+    mark_source_modified(json_object->source);
+}
+
+void array_mark_modified(const JsonArray* json_array) {
+    mark_source_modified(json_array->source);
+}
+
+void json_set_region_provider(region_provider_t* provider) {
+    json_cleanup();
+    arena.provider = provider;
+    temp_arena.provider = provider;
+}
+
+bool json_out_of_memory() {
+    return arena.out_of_memory;
+}
+
 void json_cleanup() {
     arena_free(&arena);
+    arena.out_of_memory = false;
+    dirty_spans = (DirtySpans){0};
+    dirty_spans_lost = false;
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define JSON_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -17,21 +19,37 @@ typedef enum {
     STRING,
     NUMBER,
     BOOLEAN,
-    NILL
+    NILL,
+    // only set by the parser with JSON_PARSE_RAW_NUMBERS, number_text views
+    // the source digits, read it with json_number*
+    RAW_NUMBER
 } JSON_VALUE_TYPE;
 
 struct JsonElement;
 
+struct JsonObjectIndex;
+
+// with JSON_PARSE_KEEP_SOURCE source/source_length span the parsed text of
+// the container, it is copied verbatim by write_json as long as nothing
+// inside it was modified. source is NULL otherwise.
+// index is the hash index built by the object_set_*/object_remove functions
+// on large objects, the elements they remove keep name == NULL until the
+// object is compacted again
 typedef struct {
     struct JsonElement* items;
     size_t capacity;
     size_t count;
+    const char* source;
+    size_t source_length;
+    struct JsonObjectIndex* index;
 } JsonObject;
 
 typedef struct {
     struct JsonValue* items;
     size_t capacity;
     size_t count;
+    const char* source;
+    size_t source_length;
 } JsonArray;
 
 typedef struct JsonValue {
@@ -41,6 +59,10 @@ typedef struct JsonValue {
         JsonArray array;
         char* string;
         double number;
+        struct {
+            const char* number_text;
+            size_t number_length;
+        };
         bool boolean;
         void* nill;
     };
@@ -51,10 +73,113 @@ typedef struct JsonElement{
     JsonValue value;
 } JsonElement;
 
+typedef enum {
+    JSON_PARSE_DEFAULT = 0,
+    JSON_PARSE_VALIDATE_UTF8 = 1 << 0,
+    JSON_PARSE_RAW_NUMBERS = 1 << 1,
+    JSON_PARSE_KEEP_SOURCE = 1 << 2
+} JSON_PARSE_FLAGS;
+
+typedef enum {
+    COLUMN_NUMBER,
+    COLUMN_INT64,
+    COLUMN_STRING,
+    COLUMN_BOOLEAN
+} JSON_COLUMN_TYPE;
+
+// name and type are set by the caller, the buffers are allocated by
+// extract_columns. Bit i of nulls is set when record i lacks the field or
+// holds another type, string i is data[offsets[i]..offsets[i+1]]
+typedef struct {
+    const char* name;
+    JSON_COLUMN_TYPE type;
+    union {
+        double* numbers;
+        int64_t* integers;
+        bool* booleans;
+        size_t* offsets;
+    };
+    char* data;
+    uint8_t* nulls;
+} JsonColumn;
+
+// destination of the streaming functions, either a fixed buffer (fd < 0)
+// that fails once full, or a staging buffer flushed to fd
+typedef struct {
+    char* data;
+    size_t capacity;
+    size_t count;
+    int fd;
+    bool failed;
+} JsonOutput;
+
+#define JSON_WRITER_MAX_DEPTH 256
+
+// emits JSON straight to output, separators are inserted by the writer and
+// nesting mistakes are caught by assert. Nesting deeper than
+// JSON_WRITER_MAX_DEPTH marks the output as failed
+typedef struct {
+    JsonOutput* output;
+    size_t depth;
+    bool need_comma;
+    bool after_key;
+    bool in_object[JSON_WRITER_MAX_DEPTH];
+} JsonWriter;
+
 JsonObject parse_json_string(const char* json_string, bool* valid);
+// on a lexical error (unclosed string, unknown symbol, invalid utf-8 when
+// JSON_PARSE_VALIDATE_UTF8 is set) or a token after the root object,
+// error_offset receives its byte offset
+JsonObject parse_json_string_with_flags(const char* json_string, int flags, bool* valid, size_t* error_offset);
+bool validate_utf8(const char* data, size_t length, size_t* error_offset);
+
+JsonOutput json_output_buffer(char* data, size_t capacity);
+JsonOutput json_output_fd(int fd, char* data, size_t capacity);
+bool json_output_write(JsonOutput* output, const char* data, size_t length);
+bool json_output_flush(JsonOutput* output);
+
+JsonWriter json_writer(JsonOutput* output);
+void json_writer_begin_object(JsonWriter* writer);
+void json_writer_end_object(JsonWriter* writer);
+void json_writer_begin_array(JsonWriter* writer);
+void json_writer_end_array(JsonWriter* writer);
+void json_writer_key(JsonWriter* writer, const char* name);
+void json_writer_string(JsonWriter* writer, const char* value);
+void json_writer_number(JsonWriter* writer, double number);
+void json_writer_int64(JsonWriter* writer, int64_t number);
+void json_writer_boolean(JsonWriter* writer, bool boolean);
+void json_writer_null(JsonWriter* writer);
+bool json_writer_finish(JsonWriter* writer);
+
+// check the same grammar as parse_json_string without allocating anything,
+// json_minify also copies the text without whitespace to output. An fd
+// output receives nothing unless the whole text is valid, at the cost of a
+// validation pass first, a buffer output may hold a partial copy on failure
+bool json_validate(const char* json_string, int flags, size_t* error_offset);
+bool json_minify(const char* json_string, int flags, JsonOutput* output, size_t* error_offset);
 char* write_json(const JsonObject* json_object);
 const JsonValue* get_by_name(const JsonObject* json_object, const char* name);
 
+double json_number(const JsonValue* json_value);
+// false when the number is not an integer or does not fit
+bool json_number_int64(const JsonValue* json_value, int64_t* number);
+// source digits when kept, otherwise the canonical form of the double
+const char* json_number_text(const JsonValue* json_value, size_t* length);
+// turns a RAW_NUMBER into a NUMBER, mark the container modified for write_json
+void json_set_number(JsonValue* json_value, double number);
+
+// sorted keys, no whitespace, '"', '\\' and control characters escaped in
+// strings, integers without fraction and other numbers in their shortest
+// round-trip form
+char* write_json_canonical(const JsonObject* json_object);
+// FNV-1a 64 of the canonical form, computed without building it,
+// false when the scratch memory needed to sort keys ran out
+bool json_hash(const JsonObject* json_object, uint64_t* hash);
+uint64_t json_hash_bytes(const char* data, size_t length);
+// true when both canonical forms are equal, callers holding json_hash
+// values should compare them first
+bool json_equal(const JsonObject* a, const JsonObject* b);
+
 void object_add_string(JsonObject* json_object, const char* name, const char* value);
 void object_add_number(JsonObject* json_object, const char* name, double number);
 void object_add_boolean(JsonObject* json_object, const char* name, bool boolean);
@@ -69,7 +194,37 @@ void array_add_null(JsonArray* json_array);
 void array_add_object(JsonArray* json_array, JsonObject value);
 void array_add_array(JsonArray* json_array, JsonArray value);
 
+void object_set_string(JsonObject* json_object, const char* name, const char* value);
+void object_set_number(JsonObject* json_object, const char* name, double number);
+void object_set_boolean(JsonObject* json_object, const char* name, bool boolean);
+void object_set_null(JsonObject* json_object, const char* name);
+void object_set_object(JsonObject* json_object, const char* name, JsonObject value);
+void object_set_array(JsonObject* json_object, const char* name, JsonArray value);
+bool object_remove(JsonObject* json_object, const char* name);
+
+bool array_insert(JsonArray* json_array, size_t position, JsonValue value);
+bool array_remove(JsonArray* json_array, size_t position);
+
+// returns the number of rows, one per element of records
+size_t extract_columns(const JsonArray* records, JsonColumn* columns, size_t column_count);
+
+// for values changed in place without the builders above
+void object_mark_modified(const JsonObject* json_object);
+void array_mark_modified(const JsonArray* json_array);
+
+// deep copy laid out depth first in one block allocated from ctx, cloning
+// into a caller arena compacts a document that outlives the global one.
+// The copy does not keep source spans so write_json re-serializes it,
+// ctx->out_of_memory tells an empty result from a failed allocation
+JsonObject json_clone(arena_t* ctx, const JsonObject* json_object);
+
 void print_json_object(const JsonObject* json_object, size_t indent);
+// true once an allocation failed, the builders above then dropped their
+// element and parse_json_string, write_json, write_json_canonical and
+// extract_columns fail until json_cleanup
+bool json_out_of_memory();
+// releases everything allocated so far, later allocations come from provider
+void json_set_region_provider(region_provider_t* provider);
 void json_cleanup();
 
 #endif // JSON_H
\ No newline at end of file